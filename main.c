@@ -20,16 +20,46 @@
 #include <stdbool.h>
 
 #include <avr/io.h>
+#include <avr/eeprom.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/power.h>
 #include <avr/sleep.h>
 #include <avr/wdt.h>
 
+#include <util/crc16.h>
 #include <util/delay.h>
 
-#define SPINDLE_START_TIME_MS	500	/* duration of start pulse */
+/*
+ * Clock profile, selected by F_CPU (CPUFREQ in the Makefile). The CPU runs
+ * from the 8MHz internal oscillator through the CLKPR prescaler, which is
+ * set at startup so the result doesn't depend on the CKDIV8 fuse. 1MHz is
+ * plenty for this job; 8MHz cuts loop and interrupt latency by 8x at the
+ * cost of more supply current. The other divisions (500kHz, 2MHz, 4MHz)
+ * have no Timer1 prescale giving 125 counts per millisecond, so the start
+ * pulse would no longer fit in one compare.
+ */
+#define CLOCK_OSC_HZ		8000000UL	/* internal RC oscillator */
+#if F_CPU == CLOCK_OSC_HZ
+# define CLOCK_DIV		clock_div_1
+#elif F_CPU == CLOCK_OSC_HZ / 8
+# define CLOCK_DIV		clock_div_8
+#else
+# error "F_CPU must be 1MHz or 8MHz"
+#endif
+
+#define SPINDLE_START_TIME_US	500000UL /* duration of start pulse */
+#define RELAY_SETTLE_TIME_US	15000UL	/* direction relay settle time */
 #define SPINDLE_COAST_TIME_MS	1000	/* holdoff after spindle stop */
 #define COLD_START_TIME_MS	2000	/* holdoff on startup */
 #define ERROR_RECOVER_TIME_MS	5000	/* holdoff after error */
+#define OVERLAP_WINDOW_MS	50	/* fwd+rev tolerated for; 0 disables */
+#define RELAY_STICKY		1	/* relay keeps direction when idle */
+#define BEMF_THRESHOLD		0	/* stopped below (ADCH); 0 disables */
+#define BEMF_QUIET_SAMPLES	4	/* consecutive readings below it */
+#define BEMF_PERIOD_MS		5	/* back-EMF sample interval */
+#define BEMF_BLANK_MS		20	/* contactor drop-out before sampling */
+#define TELEMETRY_BAUD		0	/* PA2 transition log, e.g. 2400 */
 #define STATUS_TIME_UNIT_MS	100	/* status LED morse code time unit */
 #define STATUS_TIME_DOT		(1 * STATUS_TIME_UNIT_MS)
 #define STATUS_TIME_DASH	(3 * STATUS_TIME_UNIT_MS)
@@ -41,116 +71,636 @@ enum state {
 	S_COLD_START,		/* initial state */
 	S_ESTOPPED,		/* estop asserted */
 	S_READY,		/* estop clear but no spindle dir asserted */
+	S_FWD_PRESTART,		/* direction relay settling for fwd */
 	S_FWD_START,		/* spindle fwd asserted; start pulse active */
 	S_FWD,			/* spindle fwd */
 	S_FWD_SPINDOWN,		/* hold delay after spindle fwd deassert */
+	S_FWD_REVERSING,	/* hold delay after fwd, rev queued */
+	S_REV_PRESTART,		/* direction relay settling for rev */
 	S_REV_START,		/* spindle rev asserted; start pulse active */
 	S_REV,			/* spindle rev */
 	S_REV_SPINDOWN,		/* hold delay after spindle fwd deassert */
+	S_REV_REVERSING,	/* hold delay after rev, fwd queued */
 	S_MAX,			/* maximum state value: do not use */
 };
 
 /* current state */
 static enum state state = S_COLD_START;
 
-/* 1KHz timer interrupt */
-static uint32_t timer_1k;		/* tick count; don't use directly */
-static uint16_t timer_1k_oneshot;	/* oneshot countdown timer */
-static bool timer_1k_done;		/* timer expired; don't use directly */
+/*
+ * Tickless timebase. Timer1 free-runs at F_CPU/TIMER_PRESCALE and its overflow
+ * interrupt extends the count to 32 bits. Instead of interrupting at a
+ * fixed 1KHz, the compare B unit is programmed for the earliest pending
+ * deadline, so the CPU is only disturbed when something is actually due
+ * (plus one overflow every 65536 counts).
+ *
+ * Deadlines live in a small fixed wheel of slots, each owned by one user.
+ * Arming and cancelling a slot are constant time; expiry is detected in
+ * the interrupt, which sets the slot's bit in timer_expired for the main
+ * loop to test without having to read the counter. Main loop slots also
+ * set their bit in timer_fresh, which the main loop takes and clears to
+ * find out what has happened since it last looked; a slot that is re-armed
+ * and expires again shows up there even though timer_expired looks the same.
+ */
 
-ISR(TIM0_COMPA_vect)
+/*
+ * Timer1 prescale: the largest that still gives a whole number of counts
+ * per millisecond at this F_CPU, to minimise overflow interrupts.
+ */
+#if (F_CPU % 1000) != 0
+# error "F_CPU must be a whole number of kHz"
+#elif ((F_CPU / 1000) % 1024) == 0
+# define TIMER_PRESCALE		1024
+# define TIMER_CS		((1 << CS12) | (1 << CS10))
+#elif ((F_CPU / 1000) % 256) == 0
+# define TIMER_PRESCALE		256
+# define TIMER_CS		(1 << CS12)
+#elif ((F_CPU / 1000) % 64) == 0
+# define TIMER_PRESCALE		64
+# define TIMER_CS		((1 << CS11) | (1 << CS10))
+#elif ((F_CPU / 1000) % 8) == 0
+# define TIMER_PRESCALE		8
+# define TIMER_CS		(1 << CS11)
+#else
+# define TIMER_PRESCALE		1
+# define TIMER_CS		(1 << CS10)
+#endif
+#define TIMER_TICKS_PER_MS	(F_CPU / TIMER_PRESCALE / 1000)
+#if TIMER_TICKS_PER_MS * TIMER_PRESCALE * 1000 != F_CPU
+# error "Timer1 millisecond is not exact"
+#endif
+#define TIMER_MIN_DELTA		4	/* nearer deadlines expire at once */
+#define MS_TO_TICKS(ms)		((uint32_t)(ms) * TIMER_TICKS_PER_MS)
+
+/* timer slots */
+#define TIMER_HOLDOFF		0	/* cold start and error recovery */
+#define TIMER_START		1	/* relay settled, or start pulse done */
+#define TIMER_COAST		2	/* spindle spindown holdoff */
+#define TIMER_STATUS		3	/* status LED phase; run in interrupt */
+#define TIMER_SUPERVISOR	4	/* watchdog heartbeat */
+#define TIMER_DEBOUNCE		5	/* input sampling; run in interrupt */
+#define TIMER_OVERLAP		6	/* fwd+rev direction handover window */
+#define TIMER_BEMF		7	/* back-EMF sampling; in interrupt */
+#define TIMER_NSLOTS		8
+
+/*
+ * Slot deadlines are kept to 16 bits in units of TIMER_SLOT_UNIT counts
+ * (256us), rounded up, which reaches a little over 8s ahead.
+ */
+#define TIMER_SLOT_SHIFT	5
+#define TIMER_SLOT_UNIT		(1 << TIMER_SLOT_SHIFT)
+#define TIMER_SLOT_MAX_MS \
+	(0x7fffUL * TIMER_SLOT_UNIT / TIMER_TICKS_PER_MS)
+#if ERROR_RECOVER_TIME_MS >= TIMER_SLOT_MAX_MS || \
+    COLD_START_TIME_MS >= TIMER_SLOT_MAX_MS || \
+    SPINDLE_COAST_TIME_MS >= TIMER_SLOT_MAX_MS
+# error "holdoff too long for the timer slots"
+#endif
+
+static volatile uint16_t timer_epoch;	/* Timer1 overflow count */
+static uint16_t timer_deadline[TIMER_NSLOTS]; /* in TIMER_SLOT_UNITs */
+static uint16_t timer_next;		/* deadline compare B is set for */
+static volatile uint8_t timer_armed;	/* bitmask of pending slots */
+static volatile uint8_t timer_expired;	/* bitmask of expired slots */
+static volatile uint8_t timer_fresh;	/* main loop slots newly expired */
+
+/* slots serviced in interrupt context, which don't wake the main loop */
+#define TIMER_ISR_SLOTS \
+	((1 << TIMER_STATUS) | (1 << TIMER_DEBOUNCE) | (1 << TIMER_BEMF))
+/* slots whose expiry can change the state */
+#define TIMER_STATE_SLOTS \
+	((1 << TIMER_HOLDOFF) | (1 << TIMER_START) | (1 << TIMER_COAST) | \
+	(1 << TIMER_OVERLAP))
+
+/*
+ * Every interrupt handler that touches a 16 bit Timer1 register bumps
+ * this sequence number on its way out. The main loop uses it to detect
+ * that its own reads were interleaved with an interrupt (which might have
+ * advanced the epoch or clobbered the shared TEMP latch) and retry,
+ * rather than masking interrupts. Kept in GPIOR0 for single cycle access.
+ */
+#define timer_seq		GPIOR0
+
+/*
+ * Interrupt latency accounting. The worst case latency any interrupt can
+ * see is the longest period that interrupts are held off, either inside
+ * a critical section or by another handler, plus the few cycles of
+ * interrupt entry. The longest period observed since reset is kept here,
+ * in CPU cycles, at the resolution of one Timer1 count. The longest
+ * path expected is timer_schedule() with every slot armed.
+ */
+uint16_t irqoff_max_cycles;
+
+/* note the end of a period with interrupts masked that began at t0 */
+static void
+irqoff_note(uint16_t t0)
 {
-	timer_1k++;
-	if (timer_1k_oneshot != 0) {
-		if (--timer_1k_oneshot == 0)
-			timer_1k_done = true;
-	}
+	uint16_t cycles = (TCNT1 - t0) * TIMER_PRESCALE;
+
+	if (cycles > irqoff_max_cycles)
+		irqoff_max_cycles = cycles;
 }
 
-static void
-timer_1k_init(void)
+static uint16_t crit_t0;		/* start of outermost section */
+
+/*
+ * Nesting-safe critical sections: crit_enter() returns the previous
+ * interrupt state for crit_exit() to restore, so they may be used from
+ * contexts that already have interrupts disabled. Only the outermost
+ * section is timed.
+ */
+static uint8_t
+crit_enter(void)
 {
+	uint8_t sreg = SREG;
+
 	cli();
-	TCCR0A = (1 << WGM01); /* timer0 CTC mode */
-	TCCR0B = 0;
-	TIMSK0 = (1 << OCIE0A); /* enable CTC interrupt */
+	if ((sreg & (1 << SREG_I)) != 0)
+		crit_t0 = TCNT1;
+	return sreg;
+}
 
-	OCR0A = 125; /* 1ms for 1MHz CPU and /8 prescale */
-	TCCR0B = (1 << CS01); /* /8 prescale */
-	sei();
+static void
+crit_exit(uint8_t sreg)
+{
+	if ((sreg & (1 << SREG_I)) != 0)
+		irqoff_note(crit_t0);
+	/* keep stores to shared data inside, as ATOMIC_RESTORESTATE does */
+	__asm__ __volatile__("" ::: "memory");
+	SREG = sreg;
 }
 
-/* access to monotonic 1KHz tick count. NB. wraps */
+/*
+ * Current 32 bit count. Safe to call from any context without masking
+ * interrupts: if a timer interrupt ran part way through then the reads
+ * are simply repeated. NB. wraps
+ */
 static uint32_t
-timer_1k_val(void)
+timer_now(void)
 {
-	uint32_t ret;
+	uint16_t epoch, count;
+	uint8_t seq, ovf;
 
-	cli();
-	ret = timer_1k;
-	sei();
-	return ret;
+	do {
+		seq = timer_seq;
+		epoch = timer_epoch;
+		count = TCNT1;
+		ovf = TIFR1 & (1 << TOV1);
+	} while (seq != timer_seq);
+	/* account for an overflow that has not been serviced yet */
+	if (ovf != 0 && count < 0x8000)
+		epoch++;
+	return ((uint32_t)epoch << 16) | count;
 }
 
-/* start oneshot countdown timer, clobbering any existing timer running */
+/*
+ * Program compare B to fire at the specified deadline, or as soon as it
+ * safely can if the deadline is already (nearly) due, so that expiry and
+ * the interrupt-context slot handlers always run from the interrupt.
+ * Deadlines more than one epoch away are left for a later overflow
+ * interrupt to pick up. Call with interrupts disabled and the time, as
+ * sampled by the caller.
+ */
 static void
-timer_oneshot(uint16_t ms)
+timer_program(uint32_t when, uint32_t now)
+{
+	int32_t delta = (int32_t)(when - now);
+
+	timer_next = (when + TIMER_SLOT_UNIT - 1) >> TIMER_SLOT_SHIFT;
+	if (delta > 0xffff) {
+		TIMSK1 &= ~(1 << OCIE1B);
+		return;
+	}
+	if (delta < TIMER_MIN_DELTA)
+		OCR1B = TCNT1 + TIMER_MIN_DELTA;
+	else
+		OCR1B = (uint16_t)when;
+	TIFR1 = (1 << OCF1B); /* discard any stale match */
+	/*
+	 * Don't let a near match slip past while programming. Only a near
+	 * one can, and one more than half an epoch away would look overdue
+	 * to the signed 16 bit test.
+	 */
+	if (delta < 0x100)
+		while ((int16_t)(OCR1B - TCNT1) <= 0)
+			OCR1B = TCNT1 + TIMER_MIN_DELTA;
+	TIMSK1 |= (1 << OCIE1B);
+}
+
+/* counts from now until a slot deadline, negative once it has passed */
+static int32_t
+timer_until(uint16_t deadline, uint32_t now)
+{
+	int16_t units = deadline - (uint16_t)(now >> TIMER_SLOT_SHIFT);
+
+	return (int32_t)units * TIMER_SLOT_UNIT -
+	    (int32_t)(now & (TIMER_SLOT_UNIT - 1));
+}
+
+/*
+ * Expire any slots whose deadlines have passed and program the compare
+ * unit for the earliest remaining one. Called from the timer interrupts.
+ */
+static void
+timer_schedule(void)
+{
+	uint32_t now = timer_now();
+	int32_t delta, best = INT32_MAX;
+	uint8_t i, bit;
+
+	for (i = 0, bit = 1; i < TIMER_NSLOTS; i++, bit <<= 1) {
+		if ((timer_armed & bit) == 0)
+			continue;
+		delta = timer_until(timer_deadline[i], now);
+		if (delta < TIMER_MIN_DELTA) {
+			timer_armed &= ~bit;
+			timer_expired |= bit;
+			timer_fresh |= bit & ~TIMER_ISR_SLOTS;
+		} else if (delta < best)
+			best = delta;
+	}
+	if (timer_armed == 0)
+		TIMSK1 &= ~(1 << OCIE1B);
+	else
+		timer_program(now + best, now);
+}
+
+static void status_advance(void);
+static void input_debounce(void);
+static void bemf_sample(void);
+
+/* run the slots that are serviced in interrupt context */
+static void
+timer_dispatch(void)
+{
+	uint8_t expired = timer_expired & TIMER_ISR_SLOTS;
+
+	timer_expired &= ~expired;
+	if ((expired & (1 << TIMER_STATUS)) != 0)
+		status_advance();
+	if ((expired & (1 << TIMER_DEBOUNCE)) != 0)
+		input_debounce();
+	if ((expired & (1 << TIMER_BEMF)) != 0)
+		bemf_sample();
+}
+
+ISR(TIM1_OVF_vect)
+{
+	uint16_t t0 = TCNT1;
+
+	timer_epoch++;
+	if (timer_armed != 0) {
+		timer_schedule();
+		timer_dispatch();
+	}
+	timer_seq++;
+	irqoff_note(t0);
+}
+
+ISR(TIM1_COMPB_vect)
+{
+	uint16_t t0 = TCNT1;
+
+	timer_schedule();
+	timer_dispatch();
+	timer_seq++;
+	irqoff_note(t0);
+}
+
+static void
+timer_init(void)
 {
 	cli();
-	timer_1k_done = false;
-	timer_1k_oneshot = ms;
+	TCCR1A = 0; /* timer1 normal mode */
+	TCCR1B = 0;
+	TCNT1 = 0;
+	TIFR1 = (1 << TOV1) | (1 << OCF1B);
+	TIMSK1 = (1 << TOIE1); /* compare B enabled only when needed */
+	TCCR1B = TIMER_CS;
 	sei();
 }
 
-/* access to countdown timer expired status */
+/* timer_set() with interrupts disabled and the time already sampled */
+static void
+timer_insert(uint8_t slot, uint32_t when, uint32_t now)
+{
+	uint8_t bit = 1 << slot;
+	uint16_t deadline = (when + TIMER_SLOT_UNIT - 1) >> TIMER_SLOT_SHIFT;
+
+	timer_deadline[slot] = deadline;
+	timer_expired &= ~bit;
+	/* only reprogram the hardware if this is now the first deadline */
+	if (timer_armed == 0 || (int16_t)(deadline - timer_next) < 0)
+		timer_program(now + timer_until(deadline, now), now);
+	timer_armed |= bit;
+}
+
+/* set a slot's absolute deadline, clobbering any existing one it had */
+static void
+timer_set(uint8_t slot, uint32_t when)
+{
+	uint8_t sreg = crit_enter();
+
+	timer_insert(slot, when, timer_now());
+	crit_exit(sreg);
+}
+
+/* start a slot's timer to expire ms from now */
+static void
+timer_arm(uint8_t slot, uint16_t ms)
+{
+	uint8_t sreg = crit_enter();
+	uint32_t now = timer_now();
+
+	timer_insert(slot, now + MS_TO_TICKS(ms), now);
+	crit_exit(sreg);
+}
+
+/*
+ * Deadline scheduling for periodic or sequenced work. The caller advances
+ * its deadline from the previous deadline rather than from whenever it
+ * noticed the expiry, so lateness in the main loop doesn't accumulate.
+ * All comparisons are signed differences, so they survive the counter
+ * wrapping.
+ */
+uint16_t deadline_overruns;	/* deadlines already passed when set */
+
+/*
+ * Arm a slot for an absolute deadline. Returns false and counts an overrun
+ * if it has already passed, i.e. the caller fell at least a whole period
+ * behind; it should then advance to the following deadline to catch up.
+ */
 static bool
-timer_oneshot_done(void)
+timer_arm_at(uint8_t slot, uint32_t when)
 {
-	bool ret;
+	uint8_t sreg = crit_enter();
+	uint32_t now = timer_now();
+	bool ok = (int32_t)(now - when) < 0;
 
-	cli();
-	ret = timer_1k_done;
-	sei();
-	return ret;
+	if (ok)
+		timer_insert(slot, when, now);
+	else
+		deadline_overruns++;
+	crit_exit(sreg);
+	return ok;
+}
+
+/*
+ * Cancel a slot's timer. The compare unit is left alone; if it was set
+ * for this slot then the interrupt will simply find nothing to do.
+ */
+static void
+timer_cancel(uint8_t slot)
+{
+	uint8_t sreg = crit_enter();
+
+	timer_armed &= ~(1 << slot);
+	timer_expired &= ~(1 << slot);
+	crit_exit(sreg);
 }
 
-/* cancel a scheduled countdown timer */
+/* expire a slot now, for a wait that turns out not to be needed */
 static void
-timer_oneshot_cancel(void)
+timer_expire(uint8_t slot)
 {
-	timer_oneshot(0);
+	uint8_t sreg = crit_enter();
+
+	timer_armed &= ~(1 << slot);
+	timer_expired |= (1 << slot);
+	timer_fresh |= (1 << slot);
+	crit_exit(sreg);
 }
 
-/* Outputs */
+/* test whether a slot's timer has expired; single byte read, no locking */
+static bool
+timer_done(uint8_t slot)
+{
+	return (timer_expired & (1 << slot)) != 0;
+}
+
+/*
+ * Inputs. A pin change interrupt on PA7 or PB0-2 starts the debouncer,
+ * which samples the inputs every DEBOUNCE_PERIOD_MS from the timer
+ * interrupt until they settle. Each accepted change is queued for the
+ * main loop, which runs the state machine only when something has
+ * changed. A snapshot is a 4 bit vector of IN_* bits taken from a single
+ * read of each port, so every decision is made from one coherent set of
+ * inputs.
+ */
+#define IN_REV			(1 << 0)	/* PB0 */
+#define IN_FWD			(1 << 1)	/* PB1 */
+#define IN_LIGHT		(1 << 2)	/* PB2 */
+#define IN_ESTOPOK		(1 << 3)	/* PA7 */
+#define IN_MAX			16
+#define INPUT_QLEN		4	/* power of two */
+#define DEBOUNCE_PERIOD_MS	1	/* sample interval while unsettled */
+#define DEBOUNCE_SAMPLES	4	/* consecutive samples to accept (1-8) */
+#if DEBOUNCE_SAMPLES < 1 || DEBOUNCE_SAMPLES > 8
+# error "DEBOUNCE_SAMPLES out of range"
+#endif
+
+static volatile uint8_t input_q[INPUT_QLEN];	/* debounced IN_* bits */
+static volatile uint8_t input_head;	/* next entry to write */
+static volatile uint8_t input_tail;	/* next entry to read */
+uint8_t input_overflows;		/* edges merged due to full queue */
+volatile uint8_t input_raw;		/* last raw sample */
+volatile uint8_t input_filtered;	/* debounced inputs */
+uint16_t input_glitches;		/* changes rejected by debouncer */
+static uint8_t db_c0, db_c1, db_c2;	/* vertical counter bit planes */
+
+/* the pins are active low and PA7 is moved down to IN_ESTOPOK */
+static uint8_t
+input_sample(void)
+{
+	uint8_t pins = (PINB & 0x07) | ((PINA >> 4) & 0x08);
 
+	return ~pins & 0x0f;
+}
+
+/*
+ * Queue a debounced input change. If the queue is full then the newest
+ * entry is overwritten, so the main loop always ends up seeing the current
+ * input levels. Called from interrupt context only.
+ */
 static void
-out_light(bool on)
+input_push(uint8_t inputs)
 {
-	PORTA = (PORTA & ~(1<<0)) | (on ? (1<<0) : 0);
+	uint8_t head = input_head;
+	uint8_t next = (head + 1) & (INPUT_QLEN - 1);
+
+	if (next == input_tail) {
+		input_overflows++;
+		next = head;
+		head = (head - 1) & (INPUT_QLEN - 1);
+	}
+	input_q[head] = inputs;
+	input_head = next;
 }
 
+/*
+ * Vertical counter debouncer, run from the timer interrupt. Each input bit
+ * has a 3 bit counter spread across db_c0-2 of the number of consecutive
+ * samples that have differed from its debounced value, so all inputs are
+ * filtered together in a handful of instructions. An input changes once
+ * DEBOUNCE_SAMPLES samples in a row have disagreed with it; a counter
+ * that is reset before getting there is counted as a glitch.
+ */
+#define DB_LAST			(DEBOUNCE_SAMPLES - 1)
+#define DB_FULL() \
+	(((DB_LAST & 1) ? db_c0 : ~db_c0) & \
+	((DB_LAST & 2) ? db_c1 : ~db_c1) & \
+	((DB_LAST & 4) ? db_c2 : ~db_c2))
+
 static void
-out_inhibit(bool on)
+input_debounce(void)
 {
-	PORTA = (PORTA & ~(1<<1)) | (on ? (1<<1) : 0);
+	uint8_t raw = input_sample();
+	uint8_t delta = raw ^ input_filtered;
+	uint8_t full, inc, carry0, carry1;
+
+	if ((~delta & (db_c0 | db_c1 | db_c2)) != 0)
+		input_glitches++;
+	full = delta & DB_FULL();
+	inc = delta & ~full;
+	carry0 = db_c0 & inc;
+	carry1 = db_c1 & carry0;
+	db_c0 = ~db_c0 & inc;
+	db_c1 = (db_c1 ^ carry0) & inc;
+	db_c2 = (db_c2 ^ carry1) & inc;
+	input_raw = raw;
+	if (full != 0) {
+		input_filtered ^= full;
+		input_push(input_filtered);
+	}
+	/* keep sampling until nothing is left counting */
+	if (inc != 0)
+		timer_arm(TIMER_DEBOUNCE, DEBOUNCE_PERIOD_MS);
 }
 
+ISR(PCINT0_vect)
+{
+	uint16_t t0 = TCNT1;
+
+	if ((timer_armed & (1 << TIMER_DEBOUNCE)) == 0)
+		timer_arm(TIMER_DEBOUNCE, DEBOUNCE_PERIOD_MS);
+	timer_seq++;
+	irqoff_note(t0);
+}
+
+ISR(PCINT1_vect, ISR_ALIASOF(PCINT0_vect));
+
+/* enable the pin change interrupts and return the initial input levels */
+static uint8_t
+input_init(void)
+{
+	PCMSK0 = (1 << PCINT7);
+	PCMSK1 = (1 << PCINT8) | (1 << PCINT9) | (1 << PCINT10);
+	GIFR = (1 << PCIF0) | (1 << PCIF1);
+	GIMSK = (1 << PCIE0) | (1 << PCIE1);
+	input_raw = input_filtered = input_sample();
+	return input_filtered;
+}
+
+/* fetch the next queued input change, if any */
+static bool
+input_get(uint8_t *inputs)
+{
+	uint8_t tail = input_tail;
+
+	if (tail == input_head)
+		return false;
+	*inputs = input_q[tail];
+	input_tail = (tail + 1) & (INPUT_QLEN - 1);
+	return true;
+}
+
+/*
+ * Outputs. The per-state outputs on PA0, PA1 and PA3 are applied together
+ * by update_outputs(). The status LED on PA4 is driven from the timer
+ * interrupt; out_status() compiles to a single sbi/cbi so it can't clobber
+ * the other PORTA bits.
+ */
+#define OUT_LIGHT		(1 << 0)	/* PA0 */
+#define OUT_INHIBIT		(1 << 1)	/* PA1 */
+#define OUT_DIRECTION		(1 << 3)	/* PA3 */
+#define OUT_ALL			(OUT_LIGHT | OUT_INHIBIT | OUT_DIRECTION)
+/*
+ * Outputs driven while idle. With RELAY_STICKY the de-energised direction
+ * relay is left where it is, so it only moves when the opposite direction
+ * is started rather than on every return to ready.
+ */
+#if RELAY_STICKY
+# define OUT_IDLE		(OUT_LIGHT | OUT_INHIBIT)
+#else
+# define OUT_IDLE		OUT_ALL
+#endif
+
+/*
+ * The start pulse is generated on OC1A (PA6) by the Timer1 compare A unit
+ * so that its width is exact and doesn't depend on the main loop. The pin
+ * is forced high and the compare unit set to clear it when the pulse is
+ * over; the interrupt then disconnects the pin and reports completion by
+ * marking the TIMER_START slot expired. Boards that still take the start
+ * from PA2 must be rewired to PA6; nothing drives PA2 with it any more.
+ */
+#define START_PULSE_TICKS \
+	(SPINDLE_START_TIME_US * TIMER_TICKS_PER_MS / 1000)
+#if START_PULSE_TICKS > 0xffff
+#error SPINDLE_START_TIME_US too long for Timer1
+#endif
+#define RELAY_SETTLE_TICKS \
+	(RELAY_SETTLE_TIME_US * TIMER_TICKS_PER_MS / 1000)
+
 static void
-out_start(bool on)
+out_start_pulse(void)
 {
-	PORTA = (PORTA & ~(1<<2)) | (on ? (1<<2) : 0);
+	uint8_t sreg = crit_enter();
+
+	timer_expired &= ~(1 << TIMER_START);
+	OCR1A = TCNT1 + START_PULSE_TICKS;
+	TCCR1A |= (1 << COM1A1) | (1 << COM1A0); /* set on match */
+	TCCR1C = (1 << FOC1A); /* force a match now: pin goes high */
+	TCCR1A &= ~(1 << COM1A0); /* clear on next (real) match */
+	TIFR1 = (1 << OCF1A);
+	TIMSK1 |= (1 << OCIE1A);
+	crit_exit(sreg);
 }
 
+/*
+ * Abort any start pulse (or relay settle) in progress; the pin reverts to
+ * PORTA (low).
+ */
 static void
-out_direction(bool on)
+out_start_cancel(void)
 {
-	PORTA = (PORTA & ~(1<<3)) | (on ? (1<<3) : 0);
+	uint8_t sreg = crit_enter();
+
+	TCCR1A &= ~((1 << COM1A1) | (1 << COM1A0));
+	TIMSK1 &= ~(1 << OCIE1A);
+	timer_cancel(TIMER_START);
+	crit_exit(sreg);
+}
+
+ISR(TIM1_COMPA_vect)
+{
+	uint16_t t0 = TCNT1;
+
+	/* hardware has already dropped the pin; just tidy up */
+	TCCR1A &= ~((1 << COM1A1) | (1 << COM1A0));
+	TIMSK1 &= ~(1 << OCIE1A);
+	timer_expired |= (1 << TIMER_START);
+	timer_fresh |= (1 << TIMER_START);
+	timer_seq++;
+	irqoff_note(t0);
 }
 
 static void
 out_status(bool on)
 {
-	PORTA = (PORTA & ~(1<<4)) | (on ? (1<<4) : 0);
+	if (on)
+		PORTA |= (1<<4);
+	else
+		PORTA &= ~(1<<4);
 }
 
 /*
@@ -158,361 +708,1211 @@ out_status(bool on)
  * The upper nibble contains the pattern length, the lower nibble contains
  * the dot/dash sequence (set bits are dash, clear are dots).
  */
-uint8_t stateblink[] = {
+const uint8_t stateblink[] PROGMEM = {
 	(4 << 4) | 0x9, /* S_ERROR		morse: -..-	'X' */
 	(3 << 4) | 0x0, /* S_COLD_START		morse: ...	'S' */
 	(1 << 4) | 0x1, /* S_ESTOPPED		morse: .	'E' */
 	(3 << 4) | 0x2, /* S_READY		morse: .-.	'R' */
+	(4 << 4) | 0x4, /* S_FWD_PRESTART	morse: ..-.	'F' */
 	(2 << 4) | 0x2, /* S_FWD_START		morse: .-	'A' */
 	(4 << 4) | 0x1, /* S_FWD		morse: -...	'B' */
 	(4 << 4) | 0x3, /* S_FWD_SPINDOWN	morse: -.-.	'C' */
+	(3 << 4) | 0x1, /* S_FWD_REVERSING	morse: -..	'D' */
+	(4 << 4) | 0x8, /* S_REV_PRESTART	morse: ...-	'V' */
 	(2 << 4) | 0x0, /* S_REV_START		morse: ..	'I' */
 	(4 << 4) | 0xe, /* S_REV		morse: .---	'J' */
 	(3 << 4) | 0x5, /* S_REV_SPINDOWN	morse: -.-	'K' */
+	(3 << 4) | 0x3, /* S_REV_REVERSING	morse: --.	'G' */
 	(3 << 4) | 0x4, /* unknown		morse: ..-	'U' */
 };
 
-/* state advance functions; these enforce preconditions and start/stop timer */
+/*
+ * Status LED engine. This runs entirely from the timer interrupt, decoding
+ * the current stateblink[] pattern as it plays. The sequence is an
+ * inter-letter gap followed by each symbol, lit, and an inter-symbol
+ * interval. Only the pattern and a phase index are kept; each phase's
+ * duration is worked out from them when it starts: phase 0 is the gap,
+ * odd phases are the lit symbols and even ones the intervals after them.
+ */
+static uint8_t status_pattern;		/* stateblink[] entry being shown */
+static uint8_t status_phase;		/* phase of the pattern playing */
+static uint32_t status_deadline;	/* end of current phase */
 
+/* move to the next phase of the pattern, skipping any that were missed */
 static void
-advance_error(void)
+status_advance(void)
 {
-	timer_oneshot(ERROR_RECOVER_TIME_MS);
-	state = S_ERROR;
+	uint16_t ms;
+
+	do {
+		if (++status_phase > 2 * (status_pattern >> 4))
+			status_phase = 0;
+		if (status_phase == 0)
+			ms = STATUS_TIME_GAP;
+		else if ((status_phase & 1) == 0)
+			ms = STATUS_TIME_INTERVAL;
+		else if ((status_pattern >> (status_phase >> 1)) & 1)
+			ms = STATUS_TIME_DASH; /* set bits are dashes */
+		else
+			ms = STATUS_TIME_DOT;
+		status_deadline += MS_TO_TICKS(ms);
+	} while (!timer_arm_at(TIMER_STATUS, status_deadline));
+	out_status(status_phase & 1);
 }
 
+/* start showing stateblink[] pattern n from its beginning */
 static void
-advance_estopped(void)
+status_show(uint8_t n)
 {
-	switch (state) {
-	case S_ERROR:
-	case S_COLD_START:
-	case S_READY:
-	case S_FWD_SPINDOWN:
-	case S_REV_SPINDOWN:
-		break;
-	default:
-		advance_error();
+	uint8_t sreg = crit_enter();
+
+	status_pattern = pgm_read_byte(&stateblink[n]);
+	status_phase = 0xff; /* so the next phase is the gap */
+	status_deadline = timer_now();
+	status_advance();
+	crit_exit(sreg);
+}
+
+/*
+ * Back-EMF sensing. While the spindle coasts, a divided down and rectified
+ * motor voltage on PA5 (ADC5) is sampled every BEMF_PERIOD_MS, and once
+ * BEMF_QUIET_SAMPLES readings in a row are below BEMF_THRESHOLD the motor
+ * is taken to have stopped and the coast holdoff is ended early. The coast
+ * timer keeps running, so SPINDLE_COAST_TIME_MS is still the upper bound.
+ * Sampling is done entirely in interrupt context, and stops as soon as
+ * the coast is over either way.
+ *
+ * Only enable this (BEMF_THRESHOLD of around 8) on boards that have the
+ * divider fitted: an unconnected PA5 floats and would end the holdoff
+ * while the motor is still turning.
+ */
+#if BEMF_THRESHOLD > 0
+#define BEMF_MUX		0x05	/* ADC5 against VCC */
+/* ADC clock prescale: keep it within 50-200kHz */
+#if F_CPU <= 1600000UL
+# define BEMF_ADPS		((1 << ADPS1) | (1 << ADPS0))	/* /8 */
+#elif F_CPU <= 3200000UL
+# define BEMF_ADPS		(1 << ADPS2)			/* /16 */
+#elif F_CPU <= 6400000UL
+# define BEMF_ADPS		((1 << ADPS2) | (1 << ADPS0))	/* /32 */
+#else
+# define BEMF_ADPS		((1 << ADPS2) | (1 << ADPS1))	/* /64 */
+#endif
+
+uint8_t bemf_last;			/* most recent reading */
+static uint8_t bemf_quiet;		/* consecutive readings below */
+static uint32_t bemf_deadline;		/* next sample */
+
+/* start watching a coast that has just begun */
+static void
+bemf_start(void)
+{
+	power_adc_enable();
+	ADMUX = BEMF_MUX;
+	ADCSRB = (1 << ADLAR); /* 8 bits are plenty: read ADCH only */
+	ADCSRA = (1 << ADEN) | (1 << ADIE) | BEMF_ADPS;
+	bemf_quiet = 0;
+	bemf_deadline = timer_now() + MS_TO_TICKS(BEMF_BLANK_MS);
+	timer_set(TIMER_BEMF, bemf_deadline);
+}
+
+/* stop sampling; safe to call whether or not it is running */
+static void
+bemf_stop(void)
+{
+	uint8_t sreg = crit_enter();
+
+	ADCSRA = 0;
+	power_adc_disable();
+	timer_cancel(TIMER_BEMF);
+	crit_exit(sreg);
+}
+
+/* timer interrupt: start a conversion and schedule the next */
+static void
+bemf_sample(void)
+{
+	if ((timer_armed & (1 << TIMER_COAST)) == 0) {
+		/* coast timer expired first; nothing left to end */
+		ADCSRA = 0;
+		power_adc_disable();
 		return;
 	}
-	timer_oneshot_cancel();
-	state = S_ESTOPPED;
+	ADCSRA |= (1 << ADSC);
+	do {
+		bemf_deadline += MS_TO_TICKS(BEMF_PERIOD_MS);
+	} while (!timer_arm_at(TIMER_BEMF, bemf_deadline));
 }
 
+ISR(ADC_vect)
+{
+	uint16_t t0 = TCNT1;
+
+	bemf_last = ADCH;
+	if (bemf_last >= BEMF_THRESHOLD)
+		bemf_quiet = 0;
+	else if (++bemf_quiet >= BEMF_QUIET_SAMPLES) {
+		/* stopped: end the coast as if its timer had expired */
+		ADCSRA = 0;
+		power_adc_disable();
+		timer_armed &= ~((1 << TIMER_COAST) | (1 << TIMER_BEMF));
+		timer_expired |= (1 << TIMER_COAST);
+		timer_fresh |= (1 << TIMER_COAST);
+	}
+	timer_seq++;
+	irqoff_note(t0);
+}
+#else /* BEMF_THRESHOLD > 0 */
 static void
-advance_ready(void)
+bemf_start(void)
 {
-	switch (state) {
-	case S_ESTOPPED:
-	case S_FWD_SPINDOWN:
-	case S_REV_SPINDOWN:
+}
+
+static void
+bemf_stop(void)
+{
+}
+
+static void
+bemf_sample(void)
+{
+}
+#endif /* BEMF_THRESHOLD > 0 */
+
+/*
+ * State machine. Inputs are first reduced to one of a few commands, then
+ * the next state is looked up by (state, command) in a table in flash.
+ * Each entry holds two next states: one for while the state's own timer
+ * (if it has one) is still running and one for once it has expired.
+ * Transitions not listed in the table are not allowed and go to S_ERROR.
+ * Entering a state performs that state's entry action, which is where the
+ * timers are started and stopped.
+ */
+enum command {
+	CMD_FAULT = 0,		/* fwd+rev asserted together */
+	CMD_ESTOP,		/* estop asserted */
+	CMD_STOP,		/* estop clear, no spindle dir asserted */
+	CMD_FWD,		/* estop clear, spindle fwd asserted */
+	CMD_REV,		/* estop clear, spindle rev asserted */
+	CMD_HOLD,		/* fwd+rev within the handover window */
+	CMD_MAX,		/* maximum command value: do not use */
+};
+
+#define S_STAY			0x0f	/* no transition */
+/* next states while the state's timer is running and once it has expired */
+#define T(running, expired)	((uint8_t)((running) | ((expired) << 4)))
+#define A(next)			T(next, next)	/* regardless of timer */
+
+static const uint8_t transitions[S_MAX][CMD_MAX] PROGMEM = {
+	[S_ERROR] = {
+		[CMD_FAULT] =	A(S_ERROR),
+		[CMD_ESTOP] =	T(S_STAY, S_ESTOPPED),
+		[CMD_STOP] =	T(S_STAY, S_ESTOPPED),
+		[CMD_FWD] =	T(S_STAY, S_ESTOPPED),
+		[CMD_REV] =	T(S_STAY, S_ESTOPPED),
+		[CMD_HOLD] =	A(S_ERROR),
+	},
+	[S_COLD_START] = {
+		[CMD_FAULT] =	T(S_STAY, S_ESTOPPED),
+		[CMD_ESTOP] =	T(S_STAY, S_ESTOPPED),
+		[CMD_STOP] =	T(S_STAY, S_ESTOPPED),
+		[CMD_FWD] =	T(S_STAY, S_ESTOPPED),
+		[CMD_REV] =	T(S_STAY, S_ESTOPPED),
+		[CMD_HOLD] =	T(S_STAY, S_ESTOPPED),
+	},
+	[S_ESTOPPED] = {
+		[CMD_FAULT] =	A(S_ERROR),
+		[CMD_ESTOP] =	A(S_STAY),
+		[CMD_STOP] =	A(S_READY),
+		[CMD_FWD] =	A(S_READY),
+		[CMD_REV] =	A(S_READY),
+		[CMD_HOLD] =	A(S_STAY),
+	},
+	[S_READY] = {
+		[CMD_FAULT] =	A(S_ERROR),
+		[CMD_ESTOP] =	A(S_ESTOPPED),
+		[CMD_STOP] =	A(S_STAY),
+		[CMD_FWD] =	A(S_FWD_PRESTART),
+		[CMD_REV] =	A(S_REV_PRESTART),
+		[CMD_HOLD] =	A(S_STAY),
+	},
+	[S_FWD_PRESTART] = {
+		[CMD_FAULT] =	A(S_ERROR),
+		[CMD_ESTOP] =	A(S_READY),
+		[CMD_STOP] =	A(S_READY),
+		[CMD_FWD] =	T(S_STAY, S_FWD_START),
+		[CMD_REV] =	A(S_REV_PRESTART),
+		[CMD_HOLD] =	A(S_STAY),
+	},
+	[S_FWD_START] = {
+		[CMD_FAULT] =	A(S_ERROR),
+		[CMD_ESTOP] =	A(S_FWD_SPINDOWN),
+		[CMD_STOP] =	A(S_FWD_SPINDOWN),
+		[CMD_FWD] =	T(S_STAY, S_FWD),
+		[CMD_REV] =	A(S_FWD_REVERSING),
+		[CMD_HOLD] =	A(S_STAY),
+	},
+	[S_FWD] = {
+		[CMD_FAULT] =	A(S_ERROR),
+		[CMD_ESTOP] =	A(S_FWD_SPINDOWN),
+		[CMD_STOP] =	A(S_FWD_SPINDOWN),
+		[CMD_FWD] =	A(S_STAY),
+		[CMD_REV] =	A(S_FWD_REVERSING),
+		[CMD_HOLD] =	A(S_STAY),
+	},
+	[S_FWD_SPINDOWN] = {
+		[CMD_FAULT] =	A(S_ERROR),
+		[CMD_ESTOP] =	T(S_STAY, S_ESTOPPED),
+		[CMD_STOP] =	T(S_STAY, S_READY),
+		[CMD_FWD] =	A(S_FWD_START),
+		[CMD_REV] =	A(S_FWD_REVERSING),
+		[CMD_HOLD] =	A(S_STAY),
+	},
+	[S_FWD_REVERSING] = {
+		[CMD_FAULT] =	A(S_ERROR),
+		[CMD_ESTOP] =	A(S_FWD_SPINDOWN),
+		[CMD_STOP] =	A(S_FWD_SPINDOWN),
+		[CMD_FWD] =	A(S_FWD_START),
+		[CMD_REV] =	T(S_STAY, S_REV_PRESTART),
+		[CMD_HOLD] =	A(S_STAY),
+	},
+	[S_REV_PRESTART] = {
+		[CMD_FAULT] =	A(S_ERROR),
+		[CMD_ESTOP] =	A(S_READY),
+		[CMD_STOP] =	A(S_READY),
+		[CMD_FWD] =	A(S_FWD_PRESTART),
+		[CMD_REV] =	T(S_STAY, S_REV_START),
+		[CMD_HOLD] =	A(S_STAY),
+	},
+	[S_REV_START] = {
+		[CMD_FAULT] =	A(S_ERROR),
+		[CMD_ESTOP] =	A(S_REV_SPINDOWN),
+		[CMD_STOP] =	A(S_REV_SPINDOWN),
+		[CMD_FWD] =	A(S_REV_REVERSING),
+		[CMD_REV] =	T(S_STAY, S_REV),
+		[CMD_HOLD] =	A(S_STAY),
+	},
+	[S_REV] = {
+		[CMD_FAULT] =	A(S_ERROR),
+		[CMD_ESTOP] =	A(S_REV_SPINDOWN),
+		[CMD_STOP] =	A(S_REV_SPINDOWN),
+		[CMD_FWD] =	A(S_REV_REVERSING),
+		[CMD_REV] =	A(S_STAY),
+		[CMD_HOLD] =	A(S_STAY),
+	},
+	[S_REV_SPINDOWN] = {
+		[CMD_FAULT] =	A(S_ERROR),
+		[CMD_ESTOP] =	T(S_STAY, S_ESTOPPED),
+		[CMD_STOP] =	T(S_STAY, S_READY),
+		[CMD_FWD] =	A(S_REV_REVERSING),
+		[CMD_REV] =	A(S_REV_START),
+		[CMD_HOLD] =	A(S_STAY),
+	},
+	[S_REV_REVERSING] = {
+		[CMD_FAULT] =	A(S_ERROR),
+		[CMD_ESTOP] =	A(S_REV_SPINDOWN),
+		[CMD_STOP] =	A(S_REV_SPINDOWN),
+		[CMD_FWD] =	T(S_STAY, S_FWD_PRESTART),
+		[CMD_REV] =	A(S_REV_START),
+		[CMD_HOLD] =	A(S_STAY),
+	},
+};
+
+/* actions performed on entering a state */
+enum entry {
+	ENTRY_NONE = 0,
+	ENTRY_ERROR,		/* stop everything, reset error holdoff */
+	ENTRY_PRESTART,		/* start relay settle if it has to move */
+	ENTRY_START,		/* fire start pulse */
+	ENTRY_COAST,		/* stop start pulse, start spindown holdoff */
+};
+
+/*
+ * Outputs are given as a mask of the OUT_* bits that the state drives and
+ * their values. OUT_LIGHT in the value means the light follows its input.
+ */
+struct state_info {
+	uint8_t timer;		/* mask of slot providing the timer, if any */
+	uint8_t entry;		/* ENTRY_* action */
+	uint8_t out_mask;	/* OUT_* bits driven in this state */
+	uint8_t out_val;	/* values of those bits */
+};
+
+static const struct state_info state_info[S_MAX] PROGMEM = {
+	/*
+	 * NB. don't touch direction on error since we don't know what its
+	 * previous state was and we might be coming from S_REV (i.e.
+	 * energised and reversed) and must not switch direction until the
+	 * motor has spun down. The next state that drives it sets it again.
+	 */
+	[S_ERROR] =		{ 1 << TIMER_HOLDOFF,	ENTRY_ERROR,
+				    OUT_LIGHT | OUT_INHIBIT, 0 },
+	[S_COLD_START] =	{ 1 << TIMER_HOLDOFF,	ENTRY_NONE,
+				    OUT_ALL, 0 },
+	[S_ESTOPPED] =		{ 0,			ENTRY_NONE,
+				    OUT_IDLE, OUT_LIGHT },
+	[S_READY] =		{ 0,			ENTRY_NONE,
+				    OUT_IDLE, OUT_LIGHT },
+	[S_FWD_PRESTART] =	{ 1 << TIMER_START,	ENTRY_PRESTART,
+				    OUT_ALL, OUT_LIGHT },
+	[S_FWD_START] =		{ 1 << TIMER_START,	ENTRY_START,
+				    OUT_ALL, OUT_LIGHT | OUT_INHIBIT },
+	[S_FWD] =		{ 0,			ENTRY_NONE,
+				    OUT_ALL, OUT_LIGHT | OUT_INHIBIT },
+	[S_FWD_SPINDOWN] =	{ 1 << TIMER_COAST,	ENTRY_COAST,
+				    OUT_ALL, OUT_LIGHT },
+	[S_FWD_REVERSING] =	{ 1 << TIMER_COAST,	ENTRY_COAST,
+				    OUT_ALL, OUT_LIGHT },
+	[S_REV_PRESTART] =	{ 1 << TIMER_START,	ENTRY_PRESTART,
+				    OUT_ALL, OUT_LIGHT | OUT_DIRECTION },
+	[S_REV_START] =		{ 1 << TIMER_START,	ENTRY_START,
+				    OUT_ALL, OUT_ALL },
+	[S_REV] =		{ 0,			ENTRY_NONE,
+				    OUT_ALL, OUT_ALL },
+	[S_REV_SPINDOWN] =	{ 1 << TIMER_COAST,	ENTRY_COAST,
+				    OUT_ALL, OUT_LIGHT | OUT_DIRECTION },
+	[S_REV_REVERSING] =	{ 1 << TIMER_COAST,	ENTRY_COAST,
+				    OUT_ALL, OUT_LIGHT | OUT_DIRECTION },
+};
+
+/*
+ * Command for each possible input vector, generated at compile time from
+ * the rules below so that classifying the inputs is a single lookup.
+ */
+#define INPUT_COMMAND(in) \
+	((((in) & (IN_FWD | IN_REV)) == (IN_FWD | IN_REV)) ? CMD_FAULT : \
+	(((in) & IN_ESTOPOK) == 0) ? CMD_ESTOP : \
+	(((in) & IN_FWD) != 0) ? CMD_FWD : \
+	(((in) & IN_REV) != 0) ? CMD_REV : CMD_STOP)
+
+static const uint8_t input_commands[IN_MAX] PROGMEM = {
+	INPUT_COMMAND(0x0), INPUT_COMMAND(0x1),
+	INPUT_COMMAND(0x2), INPUT_COMMAND(0x3),
+	INPUT_COMMAND(0x4), INPUT_COMMAND(0x5),
+	INPUT_COMMAND(0x6), INPUT_COMMAND(0x7),
+	INPUT_COMMAND(0x8), INPUT_COMMAND(0x9),
+	INPUT_COMMAND(0xa), INPUT_COMMAND(0xb),
+	INPUT_COMMAND(0xc), INPUT_COMMAND(0xd),
+	INPUT_COMMAND(0xe), INPUT_COMMAND(0xf),
+};
+
+static void
+enter_state(enum state next)
+{
+	/* leaving the coast, however it ended: stop watching it */
+	if (pgm_read_byte(&state_info[state].timer) == (1 << TIMER_COAST) &&
+	    pgm_read_byte(&state_info[next].timer) != (1 << TIMER_COAST))
+		bemf_stop();
+	switch (pgm_read_byte(&state_info[next].entry)) {
+	case ENTRY_ERROR:
+		out_start_cancel();
+		timer_cancel(TIMER_COAST);
+		/* the holdoff starts once the fault has cleared */
+		timer_cancel(TIMER_HOLDOFF);
+		break;
+	case ENTRY_PRESTART:
+		/*
+		 * The relay only needs time to settle if this state moves
+		 * it; otherwise the wait is over before it began and the
+		 * start follows in the same evaluation.
+		 */
+		timer_cancel(TIMER_COAST);
+		if (((PORTA ^ pgm_read_byte(&state_info[next].out_val)) &
+		    OUT_DIRECTION) == 0)
+			timer_expire(TIMER_START);
+		else
+			timer_set(TIMER_START,
+			    timer_now() + RELAY_SETTLE_TICKS);
+		break;
+	case ENTRY_START:
+		timer_cancel(TIMER_COAST);
+		out_start_pulse();
+		break;
+	case ENTRY_COAST:
+		out_start_cancel();
+		/* spindown <-> reversing keeps the coast already under way */
+		if (pgm_read_byte(&state_info[state].timer) !=
+		    (1 << TIMER_COAST)) {
+			timer_arm(TIMER_COAST, SPINDLE_COAST_TIME_MS);
+			bemf_start();
+		}
 		break;
-	default:
-		advance_error();
-		return;
 	}
-	timer_oneshot_cancel();
-	state = S_READY;
+	state = next;
 }
 
+/*
+ * Direction handover. When the PLC switches between spindle forward and
+ * reverse it may briefly assert both, so fwd+rev is only treated as a
+ * fault once it has persisted for OVERLAP_WINDOW_MS. Until then it is a
+ * pending direction change, CMD_HOLD, which leaves the state (and so the
+ * outputs) as they were until one of the two is released.
+ */
+static bool overlap_pending;
+
+static uint8_t
+overlap_filter(uint8_t cmd)
+{
+	if (OVERLAP_WINDOW_MS == 0)
+		return cmd;
+	if (cmd != CMD_FAULT) {
+		if (overlap_pending) {
+			timer_cancel(TIMER_OVERLAP);
+			overlap_pending = false;
+		}
+		return cmd;
+	}
+	if (!overlap_pending) {
+		timer_arm(TIMER_OVERLAP, OVERLAP_WINDOW_MS);
+		overlap_pending = true;
+	}
+	return timer_done(TIMER_OVERLAP) ? CMD_FAULT : CMD_HOLD;
+}
+
+/* evaluate the state transition for an input vector */
 static void
-advance_fwd_start(void)
+update_state(uint8_t inputs)
 {
-	switch (state) {
-	case S_READY:
-	case S_FWD_SPINDOWN:
-		break;
-	default:
-		advance_error();
+	uint8_t next, cmd = pgm_read_byte(&input_commands[inputs & 0x0f]);
+
+	cmd = overlap_filter(cmd);
+	if (state >= S_MAX || cmd >= CMD_MAX) {
+		/* shouldn't happen */
+		enter_state(S_ERROR);
 		return;
 	}
-	timer_oneshot(SPINDLE_START_TIME_MS);
-	state = S_FWD_START;
+	/*
+	 * Recover ERROR_RECOVER_TIME_MS after the fault clears. S_ERROR is
+	 * re-entered on each CMD_FAULT/CMD_HOLD, which cancels the holdoff.
+	 */
+	if (state == S_ERROR && cmd != CMD_FAULT && cmd != CMD_HOLD &&
+	    (timer_armed & (1 << TIMER_HOLDOFF)) == 0 &&
+	    !timer_done(TIMER_HOLDOFF))
+		timer_arm(TIMER_HOLDOFF, ERROR_RECOVER_TIME_MS);
+	next = pgm_read_byte(&transitions[state][cmd]);
+	if ((timer_expired & pgm_read_byte(&state_info[state].timer)) != 0)
+		next >>= 4;
+	next &= 0x0f;
+	if (next != S_STAY)
+		enter_state(next);
 }
 
+/* maintenance counters, kept across power cycles by the journal */
+struct counters {
+	uint16_t starts[2];		/* fwd, rev */
+	uint32_t run_s;			/* seconds with the contactor enabled */
+	uint16_t relay_ops;		/* direction relay changes */
+	uint16_t errors;		/* S_ERROR entries */
+	uint8_t wdt_resets;		/* watchdog resets */
+} counters;
+
+/*
+ * Apply the current state's outputs. Writing ones to PINA toggles the
+ * corresponding PORTA bits, so all of them change in a single write and
+ * bits outside the mask (e.g. the status LED, which is changed from
+ * interrupt context) can't be disturbed.
+ */
 static void
-advance_fwd(void)
+update_outputs(uint8_t inputs)
 {
-	switch (state) {
-	case S_FWD_START:
-		break;
-	default:
-		advance_error();
-		return;
+	uint8_t mask = pgm_read_byte(&state_info[state].out_mask);
+	uint8_t val = pgm_read_byte(&state_info[state].out_val);
+	uint8_t toggle;
+
+	if ((inputs & IN_LIGHT) == 0)
+		val &= ~OUT_LIGHT;
+	/* only write the port if something actually changes */
+	if ((toggle = (PORTA ^ val) & mask) != 0) {
+		PINA = toggle;
+		if ((toggle & OUT_DIRECTION) != 0)
+			counters.relay_ops++;
 	}
-	timer_oneshot_cancel();
-	state = S_FWD;
 }
 
+/*
+ * Telemetry. Every state transition is sent as a short binary frame on PA2
+ * by a transmit-only software UART (8N1, TELEMETRY_BAUD), which is clocked
+ * by Timer0 in CTC mode so the bit timing doesn't depend on the main loop.
+ * Transitions are queued for the Timer0 interrupt, which frames them as it
+ * sends them and stops itself once the queue drains; a transition that
+ * doesn't fit is dropped and counted. The bit
+ * edges are moved by other interrupts, so keep the bit time well above
+ * irqoff_max_cycles. telemetry.py decodes the stream.
+ *
+ * Off by default: older boards still have PA2 wired to the contactor start
+ * input, and the line idling high would hold it asserted. Only set
+ * TELEMETRY_BAUD once the start pulse has been moved over to PA6.
+ *
+ * Frame, multibyte fields little endian:
+ *	0	TELEMETRY_SYNC, or TELEMETRY_SYNC_TRACE when replaying the trace
+ *	1-6	struct transition: time in Timer1 counts, states, cause, inputs
+ *	7	CRC-8 (polynomial 0x07, initial 0) of bytes 1-6
+ * The cause is the number of the timer slot whose expiry caused the
+ * transition, or one of the TELEMETRY_CAUSE_* values below. A frame is
+ * also sent at reset, with both states S_COLD_START and the MCUSR reset
+ * flags in place of the inputs.
+ */
+#define TELEMETRY_SYNC		0xa5
+#define TELEMETRY_SYNC_TRACE	0x5a
+#define TELEMETRY_CAUSE_INPUT	0x8	/* the input vector changed */
+#define TELEMETRY_CAUSE_RESET	0x9	/* startup frame */
+#define TELEMETRY_CAUSE_OTHER	0xf	/* none of the above */
+
+uint16_t telemetry_drops;		/* frames lost to a full queue */
+
+/* a state transition, as sent and as kept in the trace */
+struct transition {
+	uint32_t when;		/* Timer1 counts since reset */
+	uint8_t states;		/* old state << 4 | new state */
+	uint8_t inputs;		/* cause << 4 | IN_* bits */
+};
+#define TELEMETRY_FRAME_LEN	(sizeof(struct transition) + 2)
+
+/* work out what prompted an evaluation, given newly expired state slots */
+static uint8_t
+telemetry_cause(bool input_changed, uint8_t expired)
+{
+	uint8_t slot;
+
+	if (input_changed)
+		return TELEMETRY_CAUSE_INPUT;
+	for (slot = 0; slot < TIMER_NSLOTS; slot++)
+		if ((expired & (1 << slot)) != 0)
+			return slot;
+	return TELEMETRY_CAUSE_OTHER;
+}
+
+#if TELEMETRY_BAUD > 0
+#define TELEMETRY_QLEN		4	/* frames, power of two */
+/* Timer0 prescale: /8 if the bit time fits in 8 bits, else /64 */
+#if F_CPU / 8 / TELEMETRY_BAUD <= 256
+# define TELEMETRY_PRESCALE	8
+# define TELEMETRY_CS		(1 << CS01)
+#else
+# define TELEMETRY_PRESCALE	64
+# define TELEMETRY_CS		((1 << CS01) | (1 << CS00))
+#endif
+#define TELEMETRY_BIT \
+	((F_CPU / TELEMETRY_PRESCALE + TELEMETRY_BAUD / 2) / TELEMETRY_BAUD)
+#if TELEMETRY_BIT > 256 || TELEMETRY_BIT < 16
+# error "TELEMETRY_BAUD out of range for this F_CPU"
+#endif
+/* actual rate must be within 2% */
+#if (F_CPU / TELEMETRY_PRESCALE / TELEMETRY_BIT) * 50 > TELEMETRY_BAUD * 51 || \
+    (F_CPU / TELEMETRY_PRESCALE / TELEMETRY_BIT) * 50 < TELEMETRY_BAUD * 49
+# error "TELEMETRY_BAUD can't be generated accurately at this F_CPU"
+#endif
+
+static volatile struct transition telemetry_q[TELEMETRY_QLEN];
+static volatile uint8_t telemetry_replay; /* TELEMETRY_SYNC_TRACE, by entry */
+/* free running indices, so that all TELEMETRY_QLEN entries can be used */
+static volatile uint8_t telemetry_head;	/* written by main loop */
+static volatile uint8_t telemetry_tail;	/* written by interrupt */
+static uint8_t telemetry_pos;		/* next byte of the frame at tail */
+static uint8_t telemetry_crc;		/* of its bytes so far */
+static uint16_t telemetry_shift;	/* bits yet to send, next in bit 0 */
+
 static void
-advance_fwd_spindown(void)
+telemetry_init(void)
 {
-	switch (state) {
-	case S_FWD_START:
-	case S_FWD:
-		break;
-	default:
-		advance_error();
-		return;
+	PORTA |= (1 << 2); /* line idles high */
+	TCCR0A = (1 << WGM01); /* CTC */
+	OCR0A = TELEMETRY_BIT - 1;
+	TCCR0B = TELEMETRY_CS;
+}
+
+/* queue a frame for t, unless the queue is full */
+static bool
+telemetry_put(const struct transition *t, uint8_t sync)
+{
+	uint8_t head = telemetry_head, i = head & (TELEMETRY_QLEN - 1);
+
+	if ((uint8_t)(head - telemetry_tail) >= TELEMETRY_QLEN)
+		return false;
+	telemetry_q[i] = *t;
+	if (sync == TELEMETRY_SYNC_TRACE)
+		telemetry_replay |= (1 << i);
+	else
+		telemetry_replay &= ~(1 << i);
+	telemetry_head = head + 1;
+	/*
+	 * Start the transmitter if it is idle. Timer0 has kept running, so
+	 * begin a fresh bit period or the start bit would be cut short. Once
+	 * the interrupt has seen the new head it doesn't stop by itself.
+	 */
+	if (TIMSK0 == 0) {
+		TCNT0 = 0;
+		TIFR0 = (1 << OCF0A);
+		TIMSK0 = (1 << OCIE0A);
+	}
+	return true;
+}
+
+/* the next byte of the frame for the transition at the queue's tail */
+static uint8_t
+telemetry_byte(void)
+{
+	uint8_t i = telemetry_tail & (TELEMETRY_QLEN - 1), pos, b;
+
+	pos = telemetry_pos++;
+	if (pos == 0) {
+		telemetry_crc = 0;
+		return (telemetry_replay & (1 << i)) != 0 ?
+		    TELEMETRY_SYNC_TRACE : TELEMETRY_SYNC;
+	}
+	if (pos == TELEMETRY_FRAME_LEN - 1) {
+		/* frame done, free the entry */
+		telemetry_pos = 0;
+		telemetry_tail++;
+		return telemetry_crc;
+	}
+	b = ((const volatile uint8_t *)&telemetry_q[i])[pos - 1];
+	telemetry_crc = _crc8_ccitt_update(telemetry_crc, b);
+	return b;
+}
+
+/* one bit time has passed: send the next bit */
+ISR(TIM0_COMPA_vect)
+{
+	uint16_t t0 = TCNT1;
+
+	if (telemetry_shift == 0) {
+		if (telemetry_tail == telemetry_head) {
+			TIMSK0 = 0; /* idle; line is left high */
+			goto out;
+		}
+		/* stop bit, data LSB first, start bit */
+		telemetry_shift = (1 << 9) | (telemetry_byte() << 1);
 	}
-	timer_oneshot(SPINDLE_COAST_TIME_MS);
-	state = S_FWD_SPINDOWN;
+	if ((telemetry_shift & 1) != 0)
+		PORTA |= (1 << 2);
+	else
+		PORTA &= ~(1 << 2);
+	telemetry_shift >>= 1;
+ out:
+	timer_seq++;
+	irqoff_note(t0);
+}
+#else /* TELEMETRY_BAUD > 0 */
+static void
+telemetry_init(void)
+{
 }
 
+static bool
+telemetry_put(const struct transition *t, uint8_t sync)
+{
+	return true;
+}
+#endif /* TELEMETRY_BAUD > 0 */
+
+/* send a transition as it happens */
 static void
-advance_rev_start(void)
+telemetry_send(const struct transition *t)
 {
-	switch (state) {
-	case S_READY:
-	case S_REV_SPINDOWN:
-		break;
-	default:
-		advance_error();
+	if (!telemetry_put(t, TELEMETRY_SYNC))
+		telemetry_drops++;
+}
+
+/*
+ * Watchdog supervisor. The watchdog is only reset once the main loop has
+ * completed a full sample-decide-actuate cycle, and a heartbeat timer
+ * forces such a cycle (rechecking the inputs for missed edges) every
+ * SUPERVISOR_PERIOD_MS even when nothing else happens. The timeout is
+ * chosen from the heartbeat plus the declared worst case cycle time, with
+ * margin for the watchdog oscillator's poor accuracy, so a cycle that
+ * overruns its budget badly or a hung loop resets the MCU and releases
+ * all the outputs.
+ */
+#define SUPERVISOR_PERIOD_MS	100	/* forced cycle interval */
+#define LOOP_WORST_MS		20	/* declared worst case cycle time */
+#define WDT_MIN_MS		((SUPERVISOR_PERIOD_MS + LOOP_WORST_MS) * 3 / 2)
+#if WDT_MIN_MS <= 15
+# define WDT_TIMEOUT		WDTO_15MS
+#elif WDT_MIN_MS <= 30
+# define WDT_TIMEOUT		WDTO_30MS
+#elif WDT_MIN_MS <= 60
+# define WDT_TIMEOUT		WDTO_60MS
+#elif WDT_MIN_MS <= 120
+# define WDT_TIMEOUT		WDTO_120MS
+#elif WDT_MIN_MS <= 250
+# define WDT_TIMEOUT		WDTO_250MS
+#elif WDT_MIN_MS <= 500
+# define WDT_TIMEOUT		WDTO_500MS
+#elif WDT_MIN_MS <= 1000
+# define WDT_TIMEOUT		WDTO_1S
+#elif WDT_MIN_MS <= 2000
+# define WDT_TIMEOUT		WDTO_2S
+#else
+# error "SUPERVISOR_PERIOD_MS + LOOP_WORST_MS too long for the watchdog"
+#endif
+
+uint8_t reset_cause __attribute__((section(".noinit"))); /* MCUSR at reset */
+uint16_t loop_max_ticks;		/* longest cycle seen, Timer1 counts */
+uint16_t loop_overruns;			/* cycles longer than LOOP_WORST_MS */
+
+/*
+ * Runs before .data/.bss setup. The watchdog stays enabled across a
+ * watchdog reset while WDRF is set, so clear it before anything else.
+ */
+static void wdt_early(void) __attribute__((naked, used, section(".init3")));
+static void
+wdt_early(void)
+{
+	reset_cause = MCUSR;
+	MCUSR = 0;
+	wdt_disable();
+}
+
+/* account for a completed cycle that started at t0 and reset the watchdog */
+static void
+supervisor_cycle_done(uint32_t t0)
+{
+	uint32_t ticks = timer_now() - t0;
+
+	if (ticks > MS_TO_TICKS(LOOP_WORST_MS))
+		loop_overruns++;
+	if (ticks > loop_max_ticks)
+		loop_max_ticks = ticks > 0xffff ? 0xffff : ticks;
+	wdt_reset();
+}
+
+/*
+ * EEPROM journal. Fault records and snapshots of the maintenance counters
+ * are appended to a ring of fixed size records covering the whole EEPROM,
+ * so wear is spread evenly over it. Each record carries a sequence number
+ * to find the newest at startup, and a CRC so that one torn by a power
+ * loss is ignored. The counters are snapshotted every JOURNAL_PERIOD_MIN
+ * if they have changed, and straight after a fault.
+ *
+ * Records are written a byte at a time from the EEPROM ready interrupt,
+ * so the main loop never waits for the ~3.4ms each byte takes to program.
+ * Bytes that already hold the right value are skipped. The payload is
+ * copied when the record is started, by the main loop, so a record can't
+ * mix counter values from before and after an update; a snapshot waiting
+ * behind another record is started on the following heartbeat. A fault
+ * doesn't wait: it takes over the slot of a snapshot being written, and
+ * one following another fault still being written isn't recorded.
+ *
+ * Record layout: sequence, type, JOURNAL_PAYLOAD_LEN bytes of payload
+ * (padded with 0xff), CRC-8 of everything before it.
+ */
+#define JOURNAL_PERIOD_MIN	10	/* counter snapshot interval */
+#define JOURNAL_PERIOD_TICKS \
+	(JOURNAL_PERIOD_MIN * 60000UL / SUPERVISOR_PERIOD_MS)
+#define JOURNAL_SECOND_TICKS	(1000 / SUPERVISOR_PERIOD_MS)
+#if JOURNAL_SECOND_TICKS * SUPERVISOR_PERIOD_MS != 1000
+# error "SUPERVISOR_PERIOD_MS must divide a second"
+#endif
+#define JOURNAL_REC_LEN		16
+#define JOURNAL_PAYLOAD_LEN	(JOURNAL_REC_LEN - 3)
+#define JOURNAL_SLOTS		((E2END + 1) / JOURNAL_REC_LEN)
+#define JOURNAL_COUNTERS	1	/* payload is struct counters */
+#define JOURNAL_FAULT		2	/* payload is struct transition */
+
+static uint8_t journal_buf[JOURNAL_PAYLOAD_LEN]; /* payload being written */
+static bool journal_pending;		/* counter snapshot waiting */
+static uint8_t journal_type;		/* being written, 0 if idle */
+static uint8_t journal_slot;		/* being or next to be written */
+static uint8_t journal_seq;		/* its sequence number */
+static uint8_t journal_pos;		/* next byte of it to write */
+static uint8_t journal_crc;
+static bool journal_dirty;		/* counters changed since snapshot */
+static uint8_t journal_run_ticks;	/* run time not yet in run_s */
+static uint16_t journal_ticks;		/* heartbeats since last snapshot */
+
+_Static_assert(sizeof(struct counters) <= JOURNAL_PAYLOAD_LEN,
+    "struct counters doesn't fit in a journal record");
+
+/*
+ * Start writing a record into journal_slot, from the beginning even if
+ * another was part written there. Main loop only, interrupts masked.
+ */
+static void
+journal_start(uint8_t type, const void *payload, uint8_t len)
+{
+	memset(journal_buf, 0xff, sizeof(journal_buf));
+	memcpy(journal_buf, payload, len);
+	journal_type = type;
+	journal_pos = 0;
+	journal_crc = 0;
+	EECR = (1 << EERIE); /* interrupts at once if EEPROM is idle */
+}
+
+/* start a waiting snapshot, if idle; interrupts masked */
+static void
+journal_next(void)
+{
+	if (journal_type != 0 || !journal_pending)
 		return;
+	journal_pending = false;
+	journal_start(JOURNAL_COUNTERS, &counters, sizeof(counters));
+}
+
+/* queue a snapshot of the counters */
+static void
+journal_request(void)
+{
+	uint8_t sreg = crit_enter();
+
+	journal_pending = true;
+	journal_next();
+	crit_exit(sreg);
+}
+
+/* byte pos of the record being written */
+static uint8_t
+journal_byte(uint8_t pos)
+{
+	if (pos == 0)
+		return journal_seq;
+	if (pos == 1)
+		return journal_type;
+	if (pos == JOURNAL_REC_LEN - 1)
+		return journal_crc;
+	return journal_buf[pos - 2];
+}
+
+ISR(EE_RDY_vect)
+{
+	uint16_t t0 = TCNT1;
+	uint8_t b;
+
+	while (journal_pos < JOURNAL_REC_LEN) {
+		b = journal_byte(journal_pos);
+		journal_crc = _crc8_ccitt_update(journal_crc, b);
+		EEAR = journal_slot * JOURNAL_REC_LEN + journal_pos++;
+		EECR |= (1 << EERE);
+		if (EEDR != b) {
+			/* erase and write; EEPE must follow EEMPE at once */
+			EEDR = b;
+			EECR = (1 << EERIE) | (1 << EEMPE);
+			EECR |= (1 << EEPE);
+			goto out;
+		}
 	}
-	timer_oneshot(SPINDLE_START_TIME_MS);
-	state = S_REV_START;
+	/* record complete */
+	journal_slot = (journal_slot + 1) % JOURNAL_SLOTS;
+	journal_seq++;
+	journal_type = 0;
+	EECR = 0;
+ out:
+	timer_seq++;
+	irqoff_note(t0);
 }
 
+#define JOURNAL_EE(slot, pos) \
+	((const uint8_t *)(uintptr_t)((slot) * JOURNAL_REC_LEN + (pos)))
+
+/* check record slot in place; returns its type, or 0 if it isn't valid */
+static uint8_t
+journal_check(uint8_t slot)
+{
+	uint8_t crc = 0, i;
+
+	for (i = 0; i < JOURNAL_REC_LEN - 1; i++)
+		crc = _crc8_ccitt_update(crc,
+		    eeprom_read_byte(JOURNAL_EE(slot, i)));
+	if (crc != eeprom_read_byte(JOURNAL_EE(slot, i)))
+		return 0;
+	i = eeprom_read_byte(JOURNAL_EE(slot, 1));
+	return i == 0xff ? 0 : i;
+}
+
+/*
+ * Find the newest record to append after, and restore the counters from
+ * the newest snapshot. Sequence numbers are compared as signed
+ * differences, which works as the ring holds fewer than 128 records.
+ */
 static void
-advance_rev(void)
+journal_init(uint8_t mcusr)
 {
-	switch (state) {
-	case S_REV_START:
-		break;
-	default:
-		advance_error();
-		return;
+	uint8_t slot, type, seq, counters_slot = 0, counters_seq = 0;
+	bool found = false, have_counters = false;
+
+	for (slot = 0; slot < JOURNAL_SLOTS; slot++) {
+		if ((type = journal_check(slot)) == 0)
+			continue;
+		seq = eeprom_read_byte(JOURNAL_EE(slot, 0));
+		if (!found || (int8_t)(seq - journal_seq) >= 0) {
+			found = true;
+			journal_seq = seq;
+			journal_slot = slot;
+		}
+		if (type == JOURNAL_COUNTERS && (!have_counters ||
+		    (int8_t)(seq - counters_seq) >= 0)) {
+			have_counters = true;
+			counters_seq = seq;
+			counters_slot = slot;
+		}
+	}
+	if (found) {
+		journal_slot = (journal_slot + 1) % JOURNAL_SLOTS;
+		journal_seq++;
+	}
+	if (have_counters)
+		eeprom_read_block(&counters, JOURNAL_EE(counters_slot, 2),
+		    sizeof(counters));
+	if ((mcusr & (1 << WDRF)) != 0) {
+		counters.wdt_resets++;
+		journal_request();
 	}
-	timer_oneshot_cancel();
-	state = S_REV;
 }
 
+/* account for a state transition */
 static void
-advance_rev_spindown(void)
+journal_transition(const struct transition *t)
 {
-	switch (state) {
+	uint8_t sreg;
+
+	switch (t->states & 0x0f) {
+	case S_FWD_START:
+		counters.starts[0]++;
+		break;
 	case S_REV_START:
-	case S_REV:
+		counters.starts[1]++;
+		break;
+	case S_ERROR:
+		counters.errors++;
+		sreg = crit_enter();
+		if (journal_type != JOURNAL_FAULT)
+			journal_start(JOURNAL_FAULT, t, sizeof(*t));
+		/* and a snapshot after it that includes it */
+		journal_pending = true;
+		crit_exit(sreg);
 		break;
-	default:
-		advance_error();
+	}
+	journal_dirty = true;
+}
+
+/*
+ * Called on every supervisor heartbeat: accumulate run time, i.e. time
+ * with the contactor enabled, and take a snapshot when one is due.
+ */
+static void
+journal_tick(void)
+{
+	uint8_t sreg;
+
+	if ((pgm_read_byte(&state_info[state].out_val) & OUT_INHIBIT) != 0) {
+		if (++journal_run_ticks >= JOURNAL_SECOND_TICKS) {
+			journal_run_ticks = 0;
+			counters.run_s++;
+			journal_dirty = true;
+		}
+	}
+	if (++journal_ticks >= JOURNAL_PERIOD_TICKS) {
+		journal_ticks = 0;
+		if (journal_dirty) {
+			journal_dirty = false;
+			journal_request();
+		}
+	}
+	/* a snapshot queued behind the last record */
+	sreg = crit_enter();
+	journal_next();
+	crit_exit(sreg);
+}
+
+/*
+ * Transition trace, for post-mortem of errors. The last TRACE_LEN
+ * transitions are kept in a ring in .noinit, which survives a watchdog or
+ * external reset. Entering S_ERROR freezes it, so the transitions that
+ * led up to the error are kept however long the controller runs
+ * afterwards. At startup a trace left from before the reset is replayed
+ * on the telemetry output and then cleared; without telemetry it is kept,
+ * frozen, as it has not been read out. It can also be read with a
+ * debugger at any time.
+ */
+#define TRACE_LEN		4	/* power of two; 6 bytes of RAM each */
+#define TRACE_MAGIC		0x7ace	/* .noinit holds a trace */
+
+struct trace {
+	uint16_t magic;
+	uint8_t head;			/* next record to write */
+	uint8_t count;			/* records in use */
+	bool frozen;			/* S_ERROR seen, keep what we have */
+	struct transition rec[TRACE_LEN];
+} trace __attribute__((section(".noinit")));
+
+/* note a transition in the trace and send it; O(1) */
+static void
+trace_transition(uint8_t from, uint8_t to, uint8_t cause, uint8_t inputs)
+{
+	struct transition t;
+
+	t.when = timer_now();
+	t.states = (from << 4) | to;
+	t.inputs = (cause << 4) | (inputs & 0x0f);
+	telemetry_send(&t);
+	journal_transition(&t);
+	if (trace.frozen)
 		return;
+	trace.rec[trace.head] = t;
+	trace.head = (trace.head + 1) & (TRACE_LEN - 1);
+	if (trace.count < TRACE_LEN)
+		trace.count++;
+	if (to == S_ERROR)
+		trace.frozen = true;
+}
+
+/* replay any trace from before the reset, then start a new one */
+static void
+trace_init(uint8_t mcusr)
+{
+	uint8_t i;
+
+	/* RAM doesn't survive losing power */
+	if ((mcusr & ((1 << PORF) | (1 << BORF))) == 0 &&
+	    trace.magic == TRACE_MAGIC && trace.count <= TRACE_LEN &&
+	    trace.count != 0) {
+		if (TELEMETRY_BAUD == 0) {
+			trace.head &= TRACE_LEN - 1;
+			trace.frozen = true;
+			return;
+		}
+		for (i = trace.count; i > 0; i--) {
+			while (!telemetry_put(&trace.rec[(trace.head - i) &
+			    (TRACE_LEN - 1)], TELEMETRY_SYNC_TRACE))
+				; /* wait for the transmitter */
+		}
 	}
-	timer_oneshot(SPINDLE_COAST_TIME_MS);
-	state = S_REV_SPINDOWN;
+	memset(&trace, 0, sizeof(trace));
+	trace.magic = TRACE_MAGIC;
+}
+
+/*
+ * Idle sleep. The main loop sleeps whenever it has no events to process;
+ * the timebase, pin change and other interrupts keep running and wake it.
+ * The number of wakeups and a running average of the time spent awake
+ * after each are kept so that the cost of processing an event can be
+ * seen. A stretch awake is far shorter than a Timer1 overflow, so TCNT1
+ * alone is enough to time it.
+ */
+uint16_t idle_wakeups;			/* times woken from sleep, wraps */
+uint16_t idle_awake_avg;		/* Timer1 counts awake, 1/8 EMA */
+static uint16_t idle_awake_since;	/* TCNT1 at last wakeup */
+
+/* sleep until the next interrupt, unless an event is already pending */
+static void
+idle_wait(void)
+{
+	uint16_t awake;
+
+	/*
+	 * Interrupts are masked while checking so that an event can't
+	 * slip in between the check and the sleep. sei() takes effect
+	 * after the following instruction, so the sleep is always entered.
+	 */
+	cli();
+	if (input_tail == input_head && timer_fresh == 0) {
+		awake = TCNT1 - idle_awake_since;
+		idle_awake_avg += (awake >> 3) - (idle_awake_avg >> 3);
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
+		cli();	/* TCNT1 reads share TEMP with the interrupts */
+		idle_wakeups++;
+		idle_awake_since = TCNT1;
+	}
+	sei();
 }
 
 int
 main(void)
 {
-	enum state ostate;
-	uint32_t status_timeout = 0;
-	uint32_t status_times[32];
-	uint8_t i, j, x, status_len = 0, status_phase = 0;
+	enum state ostate, pstate;
+	struct transition boot;
+	uint8_t inputs, fresh, cause, sreg;
+	uint8_t last_inputs = 0xff;
+	uint32_t t0;
 
-	/* Leave clock at 1MHz; plenty fast for this */
-#if 0
-	CLKPR = 0x80;
-	CLKPR = 0x00; /* 8 MHz */
-#endif
+	clock_prescale_set(CLOCK_DIV);
 
-	DDRA = (1 << 0) | (1 << 1) | (1 << 2) | (1 << 3) | (1 << 4);
+	/*
+	 * PA2 (old software start pulse) is the telemetry output, or held
+	 * low without it. PA5 is the back-EMF input, so its digital buffer
+	 * is switched off.
+	 */
+	DDRA = (1 << 0) | (1 << 1) | (1 << 2) | (1 << 3) | (1 << 4) | (1 << 6);
 	DDRB = 0;
 	PORTA = (1 << 7); /* pullup: estopok */
 	PORTB = (1 << 0) | (1 << 1) | (1 << 2); /* pullup: light, fwd, rev */
+	DIDR0 = (1 << ADC5D);
+	power_adc_disable();
 
-	timer_1k_init();
+	timer_init();
+	inputs = input_init();
+	telemetry_init();
+	trace_init(reset_cause);
+	journal_init(reset_cause);
+	boot.when = timer_now();
+	boot.states = (state << 4) | state;
+	boot.inputs = (TELEMETRY_CAUSE_RESET << 4) | (reset_cause & 0x0f);
+	telemetry_send(&boot);
 
-	timer_oneshot(COLD_START_TIME_MS);
+	set_sleep_mode(SLEEP_MODE_IDLE);
+
+	timer_arm(TIMER_HOLDOFF, COLD_START_TIME_MS);
+	timer_arm(TIMER_SUPERVISOR, SUPERVISOR_PERIOD_MS);
+	status_show(state);
+	wdt_enable(WDT_TIMEOUT);
+	idle_awake_since = (uint16_t)timer_now();
 	for (;;) {
-		/* pins are active low */
-		bool in_light = !(PINB & (1<<2));
-		bool in_fwd = !(PINB & (1<<1));
-		bool in_rev = !(PINB & (1<<0));
-		bool in_estopok = !(PINA & (1<<7));
-
-		/* Update state based on inputs */
-		ostate = state;
-		switch (state) {
-		case S_ERROR:
-			/* stay in error state if inputs still bad */
-			if (in_fwd && in_rev)
-				advance_error();
-			else if (timer_oneshot_done())
-				advance_estopped(); /* recover after timeout */
-			break;
-		case S_COLD_START:
-			if (timer_oneshot_done())
-				advance_estopped();
-			break;
-		case S_ESTOPPED:
-			if (in_fwd && in_rev)
-				advance_error();
-			else if (in_estopok)
-				advance_ready();
-			break;
-		case S_READY:
-			if (in_fwd && in_rev)
-				advance_error();
-			else if (!in_estopok)
-				advance_estopped();
-			else if (in_fwd)
-				advance_fwd_start();
-			else if (in_rev)
-				advance_rev_start();
-			break;
-		case S_FWD_START:
-			if (in_fwd && in_rev)
-				advance_error();
-			else if (!in_estopok || !in_fwd)
-				advance_fwd_spindown();
-			else if (timer_oneshot_done())
-				advance_fwd();
-			break;
-		case S_FWD:
-			if (in_fwd && in_rev)
-				advance_error();
-			else if (!in_estopok || !in_fwd)
-				advance_fwd_spindown();
-			break;
-		case S_FWD_SPINDOWN:
-			if (in_fwd && in_rev)
-				advance_error();
-			else if (in_estopok && in_fwd)
-				advance_fwd_start();
-			else if (timer_oneshot_done()) {
-				if (!in_estopok)
-					advance_estopped();
-				else
-					advance_ready();
+		/* wait for an input edge or a timer to expire */
+		fresh = 0;
+		if (!input_get(&inputs)) {
+			if (timer_fresh == 0) {
+				idle_wait();
+				continue;
 			}
-			break;
-		case S_REV_START:
-			if (in_fwd && in_rev)
-				advance_error();
-			else if (!in_estopok || !in_rev)
-				advance_rev_spindown();
-			else if (timer_oneshot_done())
-				advance_rev();
-			break;
-		case S_REV:
-			if (in_fwd && in_rev)
-				advance_error();
-			else if (!in_estopok || !in_rev)
-				advance_rev_spindown();
-			break;
-		case S_REV_SPINDOWN:
-			if (in_fwd && in_rev)
-				advance_error();
-			else if (in_estopok && in_rev)
-				advance_rev_start();
-			else if (timer_oneshot_done()) {
-				if (!in_estopok)
-					advance_estopped();
-				else
-					advance_ready();
+			sreg = crit_enter();
+			fresh = timer_fresh;
+			timer_fresh = 0;
+			crit_exit(sreg);
+			if ((fresh & (1 << TIMER_SUPERVISOR)) != 0 &&
+			    timer_done(TIMER_SUPERVISOR)) {
+				timer_arm(TIMER_SUPERVISOR,
+				    SUPERVISOR_PERIOD_MS);
+				journal_tick();
+				/* recover from any missed edge */
+				if (input_sample() != input_filtered)
+					timer_arm(TIMER_DEBOUNCE,
+					    DEBOUNCE_PERIOD_MS);
+				inputs = input_filtered;
 			}
-			break;
-		default:
-			/* shouldn't happen */
-			advance_error();
-			break;
 		}
+		t0 = timer_now();
 
-		/* prepare/update Morse code status pattern on state change */
-		if (status_len == 0 || ostate != state) {
-			j = 0;
-			status_times[j++] = STATUS_TIME_GAP;
-			/*
-			 * prepare tick intervals in status_times[]
-			 * odd-numbered phases correspond to lit symbols
-			 * (i.e. dots or dashes), even numbered entries
-			 * are inter-symbol intervals or inter-letter gaps.
-			 */
-			for (i = 0; i < stateblink[state] >> 4; i++) {
-				x = ((stateblink[state] & (1 << i)) != 0);
-				status_times[j++] = x ? STATUS_TIME_DASH :
-				    STATUS_TIME_DOT;
-				status_times[j++] = STATUS_TIME_INTERVAL;
-			}
-			status_len = j;
-			status_phase = 0; /* start new sequence with gap */
-			status_timeout = timer_1k_val() + status_times[0];
-		} else if (timer_1k_val() == status_timeout) {
-			/* advance phase at expiry of current interval */
-			status_phase = (status_phase + 1) % status_len;
-			status_timeout = timer_1k_val() +
-			    status_times[status_phase];
-		}
+		/*
+		 * Nothing to do unless the inputs have changed or one of the
+		 * state timers has expired since the last evaluation. A timer
+		 * that was re-armed meanwhile just costs a redundant pass.
+		 */
+		fresh &= TIMER_STATE_SLOTS;
+		if (inputs != last_inputs || fresh != 0) {
+			cause = telemetry_cause(inputs != last_inputs, fresh);
+			last_inputs = inputs;
 
-		/* display status */
-		out_status(status_phase & 1);
-
-		/* act on current state */
-		switch (state) {
-		case S_COLD_START:
-			out_light(0);
-			out_inhibit(0);
-			out_start(0);
-			out_direction(0);
-			break;
-		case S_ESTOPPED:
-		case S_READY:
-			out_light(in_light);
-			out_inhibit(0);
-			out_start(0);
-			out_direction(0);
-			break;
-		case S_FWD_START:
-			out_light(in_light);
-			out_inhibit(1);
-			out_start(1);
-			out_direction(0);
-			break;
-		case S_FWD:
-			out_light(in_light);
-			out_inhibit(1);
-			out_start(0);
-			out_direction(0);
-			break;
-		case S_FWD_SPINDOWN:
-			out_light(in_light);
-			out_inhibit(0);
-			out_start(0);
-			out_direction(0);
-			break;
-		case S_REV_START:
-			out_light(in_light);
-			out_inhibit(1);
-			out_start(1);
-			out_direction(1);
-			break;
-		case S_REV:
-			out_light(in_light);
-			out_inhibit(1);
-			out_start(0);
-			out_direction(1);
-			break;
-		case S_REV_SPINDOWN:
-			out_light(in_light);
-			out_inhibit(0);
-			out_start(0);
-			out_direction(1);
-			break;
-		default:
-			out_light(0);
-			out_inhibit(0);
-			out_start(0);
-			/*
-			 * NB. don't touch direction on error since we don't
-			 * know what its previous state was and we might be
-			 * coming from S_REV (i.e. energised and reversed)
-			 * and must not switch direction until the motor
-			 * has spun down. The S_ERROR->S_ESTOPPED recovery
-			 * will take care of resetting it eventually.
-			 */
-			break;
+			/* Update state based on inputs until it settles */
+			ostate = state;
+			do {
+				pstate = state;
+				update_state(inputs);
+				if (state != pstate)
+					trace_transition(pstate, state, cause,
+					    inputs);
+			} while (state != pstate);
+
+			/* restart the status LED on state change */
+			if (ostate != state)
+				status_show(state);
+
+			/* act on current state */
+			update_outputs(inputs);
 		}
+
+		supervisor_cycle_done(t0);
 	}
 }
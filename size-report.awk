@@ -0,0 +1,76 @@
+#
+# Memory budget report for "make size-report". Reads the frame sizes that
+# avr-gcc writes with -fstack-usage (*.su), a disassembly of the firmware
+# for the call graph (*.dis) and then the output of "avr-size -A", prints
+# the section sizes and the worst case stack depth of main() and of the
+# interrupt handlers, and fails if less than headroom bytes of RAM would
+# be left over.
+#
+# avr-gcc's frame sizes include the saved registers and the return
+# address. Library routines have no .su entry and are counted as their
+# return address alone. Handlers don't nest, so the worst case stack is
+# main()'s deepest path plus the deepest handler's. There are no indirect
+# calls or recursion in the firmware to confuse it.
+#
+
+FILENAME ~ /\.su$/ {
+	split($0, q, "\t");
+	fn = q[1];
+	sub(/.*:/, "", fn);
+	frame[fn] = q[2] + 0;
+	next;
+}
+FILENAME ~ /\.dis$/ {
+	if (match($0, /^[0-9a-f]+ <[^>]+>:$/)) {
+		fn = $2;
+		gsub(/[<>:]/, "", fn);
+		next;
+	}
+	# calls, and jumps to the start of another function (tail calls)
+	if ($0 ~ /\t(r?call|r?jmp)\t/ && match($0, /<[^>+]+>$/)) {
+		to = substr($0, RSTART + 1, RLENGTH - 2);
+		if (to != fn)
+			calls[fn] = calls[fn] " " to;
+	}
+	next;
+}
+$1 ~ /^\.(text|data|bss|noinit)$/ {
+	size[$1] = $2;
+}
+
+function depth(f,	c, d, i, n, deepest) {
+	if (f in memo)
+		return memo[f];
+	memo[f] = 0;	# in progress; breaks any cycle in library code
+	deepest = 0;
+	n = split(calls[f], c, " ");
+	for (i = 1; i <= n; i++)
+		if ((d = depth(c[i])) > deepest)
+			deepest = d;
+	return memo[f] = ((f in frame) ? frame[f] : 2) + deepest;
+}
+
+END {
+	main_stack = depth("main");
+	for (f in frame) {
+		if (f ~ /^__vector_[0-9]+$/ && depth(f) > isr_stack) {
+			isr_stack = depth(f);
+			isr_name = f;
+		}
+	}
+	stack = main_stack + isr_stack;
+	static = size[".data"] + size[".bss"] + size[".noinit"];
+	free = ram - static - stack;
+
+	printf("flash   %5d  .text %d + .data %d, of %d\n",
+	    size[".text"] + size[".data"], size[".text"], size[".data"], flash);
+	printf("static  %5d  .data %d + .bss %d + .noinit %d\n",
+	    static, size[".data"], size[".bss"], size[".noinit"]);
+	printf("stack   %5d  main() %d + %s %d\n",
+	    stack, main_stack, isr_name, isr_stack);
+	printf("free    %5d  of %d RAM, %d required\n", free, ram, headroom);
+	if (free < headroom) {
+		print "size-report: RAM headroom exceeded" > "/dev/stderr";
+		exit 1;
+	}
+}
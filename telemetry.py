@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+#
+# Decode the spindle controller's telemetry stream (PA2, 8N1) into one
+# line per state transition. Reads a serial port, a capture file or stdin.
+# See the "Telemetry" comment in main.c for the frame format. Transitions
+# replayed from the trace after a reset are marked "trace".
+#
+# With -j, decode an EEPROM dump (avrdude -U eeprom:r:eeprom.bin:r)
+# holding the fault and counter journal instead.
+#
+# usage: telemetry.py [-b baud] [-t ticks-per-ms] [path]
+#        telemetry.py -j eeprom.bin
+#
+
+import argparse
+import os
+import struct
+import sys
+import termios
+
+SYNC = 0xa5
+SYNC_TRACE = 0x5a
+FRAME_LEN = 8
+
+# enum state in main.c
+STATES = [
+	"S_ERROR", "S_COLD_START", "S_ESTOPPED", "S_READY",
+	"S_FWD_PRESTART", "S_FWD_START", "S_FWD", "S_FWD_SPINDOWN",
+	"S_FWD_REVERSING", "S_REV_PRESTART", "S_REV_START", "S_REV",
+	"S_REV_SPINDOWN", "S_REV_REVERSING",
+]
+
+# timer slots and TELEMETRY_CAUSE_* in main.c
+CAUSES = {
+	0: "holdoff", 1: "start", 2: "coast", 6: "overlap",
+	0x8: "input", 0x9: "reset", 0xf: "other",
+}
+
+INPUTS = ["rev", "fwd", "light", "estopok"]	# IN_* bits
+RESETS = ["power-on", "external", "brown-out", "watchdog"] # MCUSR bits
+
+
+def crc8(data):
+	crc = 0
+	for b in data:
+		crc ^= b
+		for _ in range(8):
+			crc = ((crc << 1) ^ 0x07) & 0xff if crc & 0x80 \
+			    else (crc << 1) & 0xff
+	return crc
+
+
+def state_name(n):
+	return STATES[n] if n < len(STATES) else "state %d" % n
+
+
+def bits(v, names):
+	s = [name for i, name in enumerate(names) if v & (1 << i)]
+	return ",".join(s) if s else "-"
+
+
+def decode(frame, ticks_per_ms):
+	ticks, states, low = struct.unpack("<IBB", frame[1:7])
+	ms = ticks / ticks_per_ms
+	when = "%-5s %10.3f" % ("trace" if frame[0] == SYNC_TRACE else "",
+	    ms / 1000)
+	cause = low >> 4
+	if cause == 0x9:
+		return "%s reset: %s" % (when, bits(low & 0x0f, RESETS))
+	return "%s %s -> %s (%s; inputs %s)" % (when,
+	    state_name(states >> 4), state_name(states & 0x0f),
+	    CAUSES.get(cause, "cause %d" % cause), bits(low & 0x0f, INPUTS))
+
+
+# EEPROM journal, see main.c
+JOURNAL_REC_LEN = 16
+JOURNAL_COUNTERS = 1
+JOURNAL_FAULT = 2
+
+
+def journal(path, ticks_per_ms):
+	with open(path, "rb") as f:
+		data = f.read()
+	recs = []
+	for off in range(0, len(data) - JOURNAL_REC_LEN + 1, JOURNAL_REC_LEN):
+		rec = data[off:off + JOURNAL_REC_LEN]
+		if rec[1] != 0xff and crc8(rec[:-1]) == rec[-1]:
+			recs.append(rec)
+	if not recs:
+		print("journal is empty")
+		return
+	# sequence numbers wrap; the oldest follows the largest gap
+	recs.sort(key=lambda r: r[0])
+	gaps = [(recs[(i + 1) % len(recs)][0] - r[0]) % 256
+	    for i, r in enumerate(recs)]
+	first = (gaps.index(max(gaps)) + 1) % len(recs)
+	for rec in recs[first:] + recs[:first]:
+		if rec[1] == JOURNAL_COUNTERS:
+			fwd, rev, run_s, relay, errors, wdt = \
+			    struct.unpack("<HHIHHB", rec[2:15])
+			print("%3d counters: starts fwd %d rev %d, "
+			    "run %d:%02d:%02d, relay %d, errors %d, "
+			    "watchdog resets %d" % (rec[0], fwd, rev,
+			    run_s // 3600, run_s // 60 % 60, run_s % 60,
+			    relay, errors, wdt))
+		elif rec[1] == JOURNAL_FAULT:
+			print("%3d fault: %s" % (rec[0],
+			    decode(bytes([SYNC]) + rec[2:8], ticks_per_ms)))
+		else:
+			print("%3d type %d" % (rec[0], rec[1]))
+
+
+def frames(f):
+	"""Yield CRC-checked frames, resynchronising on corrupt data."""
+	buf = bytearray()
+	while True:
+		data = os.read(f, 256)
+		if not data:
+			return
+		buf += data
+		while len(buf) >= FRAME_LEN:
+			if buf[0] in (SYNC, SYNC_TRACE) and \
+			    crc8(buf[1:FRAME_LEN - 1]) == buf[FRAME_LEN - 1]:
+				yield bytes(buf[:FRAME_LEN])
+				del buf[:FRAME_LEN]
+			else:
+				del buf[0]
+
+
+def setup_tty(f, baud):
+	speed = getattr(termios, "B%d" % baud)
+	attr = termios.tcgetattr(f)
+	attr[0] = termios.IGNBRK				# iflag
+	attr[1] = 0						# oflag
+	attr[2] = termios.CS8 | termios.CREAD | termios.CLOCAL	# cflag
+	attr[3] = 0						# lflag
+	attr[4] = attr[5] = speed
+	attr[6][termios.VMIN] = 1
+	attr[6][termios.VTIME] = 0
+	termios.tcsetattr(f, termios.TCSANOW, attr)
+
+
+def main():
+	ap = argparse.ArgumentParser()
+	ap.add_argument("-b", "--baud", type=int, default=2400,
+	    help="TELEMETRY_BAUD (default 2400)")
+	ap.add_argument("-t", "--ticks-per-ms", type=int, default=125,
+	    help="TIMER_TICKS_PER_MS (default 125, right for 1 and 8MHz)")
+	ap.add_argument("-j", "--journal", action="store_true",
+	    help="path is an EEPROM dump to decode the journal from")
+	ap.add_argument("path", nargs="?", help="serial port or capture file")
+	args = ap.parse_args()
+
+	if args.journal:
+		journal(args.path, args.ticks_per_ms)
+		return
+
+	f = os.open(args.path, os.O_RDONLY) if args.path else \
+	    sys.stdin.fileno()
+	if os.isatty(f):
+		setup_tty(f, args.baud)
+	try:
+		for frame in frames(f):
+			print(decode(frame, args.ticks_per_ms), flush=True)
+	except KeyboardInterrupt:
+		pass
+
+
+if __name__ == "__main__":
+	main()